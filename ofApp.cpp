@@ -28,13 +28,128 @@ bool Plane::intersect(const Ray& ray, glm::vec3& point, glm::vec3& normalAtInter
 	return insidePlane;
 }
 
+// Signed distance from p to the (infinite) plane
+// normal is kept unit length by the constructor
+//
+float Plane::sdf(const glm::vec3& p) {
+	return glm::dot(p - position, normal);
+}
+
+// Distance estimate for the implicit shape, smooth union of all
+// primitives in the object's local space
+//
+float SDFObject::sdf(const glm::vec3& p) {
+	glm::vec3 q = p - position;
+	for (int a = 0; a < 3; a++) {
+		if (repeat[a] > 0) q[a] -= repeat[a] * glm::round(q[a] / repeat[a]);
+	}
+
+	float d = FLT_MAX;
+	for (int i = 0; i < primitives.size(); i++) {
+		const Primitive& prim = primitives[i];
+		glm::vec3 lp = q - prim.center;
+		float di;
+		switch (prim.shape) {
+		case SPHERE:
+			di = glm::length(lp) - prim.size.x;
+			break;
+		case BOX: {
+			glm::vec3 b = glm::abs(lp) - prim.size;
+			di = glm::length(glm::max(b, glm::vec3(0))) + glm::min(glm::max(b.x, glm::max(b.y, b.z)), 0.0f);
+			break;
+		}
+		case TORUS: {
+			glm::vec2 t = glm::vec2(glm::length(glm::vec2(lp.x, lp.z)) - prim.size.x, lp.y);
+			di = glm::length(t) - prim.size.y;
+			break;
+		}
+		case PLANE:
+			di = planes[prim.plane].sdf(q);
+			break;
+		default:
+			di = FLT_MAX;
+			break;
+		}
+
+		//the first primitive seeds the shape whatever its op
+		if (i == 0) {
+			d = di;
+		}
+		//intersections cut the shape built so far
+		else if (prim.op == INTERSECT) {
+			d = glm::max(d, di);
+		}
+		//polynomial smooth min
+		else if (blend <= 0) {
+			d = glm::min(d, di);
+		}
+		else {
+			float h = glm::clamp(.5f + .5f * (di - d) / blend, 0.0f, 1.0f);
+			d = glm::mix(di, d, h) - blend * h * (1 - h);
+		}
+	}
+	return d;
+}
+
+// Sphere trace the implicit shape. Rays are first clipped to the bounding
+// sphere (unless the shape repeats), then marched by the distance estimate
+// until it falls below the pixel footprint at the current distance.
+// Rays that start inside the shape, like refracted rays, march on the
+// negated field to find where they leave it
+//
+bool SDFObject::intersect(const Ray& ray, glm::vec3& point, glm::vec3& normalAtIntersect) {
+	glm::vec3 d = glm::normalize(ray.d);
+	float t = 0;
+	float tFar = maxDistance;
+
+	//bounding sphere early out, repeated shapes are not contained by it
+	if (repeat == glm::vec3(0)) {
+		glm::vec3 oc = ray.p - position;
+		float b = glm::dot(oc, d);
+		float c = glm::dot(oc, oc) - boundRadius * boundRadius;
+		float disc = b * b - c;
+		if (disc < 0) return false;
+		float sq = sqrt(disc);
+		tFar = -b + sq;
+		if (tFar < 0) return false;
+		t = glm::max(-b - sq, 0.0f);
+	}
+
+	float side = sdf(ray.p + d * t) < 0 ? -1.0f : 1.0f;
+
+	for (int i = 0; i < maxSteps && t <= tFar; i++) {
+		glm::vec3 p = ray.p + d * t;
+		float dist = side * sdf(p);
+		float epsilon = glm::max(minEpsilon, pixelAngle * t);
+		if (dist < epsilon) {
+			//normal from central differences of the field, always points out of the shape
+			float e = epsilon * .5f;
+			glm::vec3 n = glm::vec3(
+				sdf(p + glm::vec3(e, 0, 0)) - sdf(p - glm::vec3(e, 0, 0)),
+				sdf(p + glm::vec3(0, e, 0)) - sdf(p - glm::vec3(0, e, 0)),
+				sdf(p + glm::vec3(0, 0, e)) - sdf(p - glm::vec3(0, 0, e)));
+			normal = glm::normalize(n);
+			normalAtIntersect = normal;
+
+			//hits are accepted up to epsilon away, project back onto the surface
+			//so rays spawned from here start on the intended side of it
+			p -= normal * (side * dist);
+			point = p;
+			intersectionPoint = p;
+			return true;
+		}
+		t += dist;
+	}
+	return false;
+}
+
 // Convert (u, v) to (x, y, z) 
 // We assume u,v is in [0, 1]
 //
 glm::vec3 ViewPlane::toWorld(float u, float v) {
 	float w = width();
 	float h = height();
-	return (glm::vec3((u * w) + min.x, (v * h) + min.y, position.z));
+	return (position + right * ((u * w) + min.x) + up * ((v * h) + min.y));
 }
 
 // Get a ray from the current camera position to the (u, v) position on
@@ -45,6 +160,164 @@ Ray RenderCam::getRay(float u, float v) {
 	return(Ray(position, glm::normalize(pointOnPlane - position)));
 }
 
+// Recompute the view plane frame from position, aim and up.
+// If aim is parallel to up another reference axis is used for the frame.
+// Invalidates the cached ray directions
+//
+void RenderCam::updateBasis() {
+	aim = glm::normalize(aim);
+
+	//looking straight along up leaves no right vector, fall back to another reference axis
+	glm::vec3 reference = up;
+	if (glm::length(glm::cross(aim, reference)) <= 1e-4f * glm::length(reference)) {
+		reference = glm::abs(aim.z) < .9f ? glm::vec3(0, 0, 1) : glm::vec3(1, 0, 0);
+	}
+	view.right = glm::normalize(glm::cross(aim, reference));
+	view.up = glm::cross(view.right, aim);
+	view.position = position + aim * viewDistance;
+	view.normal = -aim;
+	cacheValid = false;
+}
+
+// Point the camera at target
+//
+void RenderCam::lookAt(glm::vec3 target, glm::vec3 up) {
+	aim = target - position;
+	this->up = up;
+	updateBasis();
+}
+
+// Size the view plane for a vertical field of view (degrees)
+// and aspect ratio (width / height)
+//
+void RenderCam::setFov(float fov, float aspect) {
+	float h = glm::tan(glm::radians(fov) / 2) * viewDistance;
+	view.setSize(glm::vec2(-h * aspect, -h), glm::vec2(h * aspect, h));
+	cacheValid = false;
+}
+
+// Copy the pose and field of view of an openFrameworks camera
+//
+void RenderCam::setFromCamera(ofCamera& cam, float aspect) {
+	position = cam.getGlobalPosition();
+	aim = cam.getLookAtDir();
+	up = cam.getUpDir();
+	setFov(cam.getFov(), aspect);
+	updateBasis();
+}
+
+// Normalized ray directions for the pixels of one tile, row major.
+// Directions are stepped across the view plane one pixel at a time
+// and normalized in a separate flat pass
+//
+void RenderCam::getRays(int i0, int j0, int tileWidth, int tileHeight, int imageWidth, int imageHeight, vector<glm::vec3>& dirs) {
+	glm::vec3 du = view.right * (view.width() / imageWidth);
+	glm::vec3 dv = -view.up * (view.height() / imageHeight);			// image rows go down the view plane
+	glm::vec3 row = view.toWorld(0, 1) - position + du * (i0 + .5f) + dv * (j0 + .5f);
+
+	dirs.resize(tileWidth * tileHeight);
+	for (int j = 0; j < tileHeight; j++) {
+		glm::vec3 d = row;
+		for (int i = 0; i < tileWidth; i++) {
+			dirs[j * tileWidth + i] = d;
+			d += du;
+		}
+		row += dv;
+	}
+
+	for (int k = 0; k < dirs.size(); k++) {
+		dirs[k] *= glm::inversesqrt(glm::dot(dirs[k], dirs[k]));
+	}
+}
+
+// Ray directions for the whole image, regenerated only when the
+// camera or image size changed (or caching is off). The cache is
+// filled one tile at a time so each tile is stepped and normalized
+// while it is still small enough to stay in cache
+//
+const vector<glm::vec3>& RenderCam::getDirections(int imageWidth, int imageHeight) {
+	if (!cacheRays || !cacheValid || cacheWidth != imageWidth || cacheHeight != imageHeight) {
+		const int tileSize = 32;
+		vector<glm::vec3> tile;
+		rayCache.resize(imageWidth * imageHeight);
+		for (int j0 = 0; j0 < imageHeight; j0 += tileSize) {
+			for (int i0 = 0; i0 < imageWidth; i0 += tileSize) {
+				int tileWidth = std::min(tileSize, imageWidth - i0);
+				int tileHeight = std::min(tileSize, imageHeight - j0);
+				getRays(i0, j0, tileWidth, tileHeight, imageWidth, imageHeight, tile);
+				for (int j = 0; j < tileHeight; j++) {
+					std::copy(tile.begin() + j * tileWidth, tile.begin() + (j + 1) * tileWidth, rayCache.begin() + (j0 + j) * imageWidth + i0);
+				}
+			}
+		}
+		cacheWidth = imageWidth;
+		cacheHeight = imageHeight;
+		cacheValid = true;
+	}
+	return rayCache;
+}
+
+// Approximate angle covered by one pixel at the center of the view
+//
+float RenderCam::getPixelAngle(int imageWidth) {
+	return (view.width() / imageWidth) / viewDistance;
+}
+
+//--------------------------------------------------------------
+//bins every bounded light into the cells its influence sphere overlaps
+//unbounded lights go into the global list
+void LightGrid::build(const vector<LightRecord>& lights, int maxCells) {
+	global.clear();
+	cells.clear();
+	dims = glm::ivec3(0);
+
+	glm::vec3 lo = glm::vec3(FLT_MAX);
+	glm::vec3 hi = glm::vec3(-FLT_MAX);
+	float rangeSum = 0;
+	int bounded = 0;
+	for (int i = 0; i < lights.size(); i++) {
+		if (lights[i].range <= 0) {
+			global.push_back(i);
+			continue;
+		}
+		lo = glm::min(lo, lights[i].position - lights[i].range);
+		hi = glm::max(hi, lights[i].position + lights[i].range);
+		rangeSum += lights[i].range;
+		bounded++;
+	}
+	if (bounded == 0) return;
+
+	//cells roughly the size of an average light, capped per axis
+	glm::vec3 extent = hi - lo;
+	float size = rangeSum / bounded;
+	dims = glm::clamp(glm::ivec3(glm::ceil(extent / size)), glm::ivec3(1), glm::ivec3(maxCells));
+	min = lo;
+	cellSize = extent / glm::vec3(dims);
+	cells.resize(dims.x * dims.y * dims.z);
+
+	for (int i = 0; i < lights.size(); i++) {
+		if (lights[i].range <= 0) continue;
+		glm::ivec3 c0 = glm::clamp(glm::ivec3((lights[i].position - lights[i].range - min) / cellSize), glm::ivec3(0), dims - 1);
+		glm::ivec3 c1 = glm::clamp(glm::ivec3((lights[i].position + lights[i].range - min) / cellSize), glm::ivec3(0), dims - 1);
+		for (int z = c0.z; z <= c1.z; z++) {
+			for (int y = c0.y; y <= c1.y; y++) {
+				for (int x = c0.x; x <= c1.x; x++) {
+					cells[(z * dims.y + y) * dims.x + x].push_back(i);
+				}
+			}
+		}
+	}
+}
+
+//--------------------------------------------------------------
+//returns the bounded lights that can reach point p
+const vector<int>& LightGrid::query(const glm::vec3& p) {
+	if (cells.empty()) return empty;
+	glm::ivec3 c = glm::ivec3(glm::floor((p - min) / cellSize));
+	if (glm::any(glm::lessThan(c, glm::ivec3(0))) || glm::any(glm::greaterThanEqual(c, dims))) return empty;
+	return cells[(c.z * dims.y + c.y) * dims.x + c.x];
+}
+
 //--------------------------------------------------------------
 //converts the current point on the plane to a pixel on texture map
 //returns the color from the texture
@@ -136,6 +409,16 @@ void ofApp::setup() {
 	gui.setup();
 	gui.add(intensity.setup("Light intensity", .2, .05, 1));
 	gui.add(power.setup("Phong p", 100, 10, 10000));
+	gui.add(shadowSamples.setup("Shadow samples", 4, 1, 8));
+	gui.add(rigCount.setup("Rig lights", 1000, 100, 5000));
+	gui.add(rigRange.setup("Rig light range", 1, .25, 5));
+	gui.add(rigIntensity.setup("Rig light intensity", .05, .01, .5));
+	gui.add(wavefrontToggle.setup("Wavefront", false));
+	gui.add(maxDepth.setup("Max depth", 4, 1, 10));
+	gui.add(rouletteDepth.setup("Roulette depth", 2, 0, 10));
+	gui.add(denoiseToggle.setup("Denoise", false));
+	gui.add(denoisePasses.setup("Denoise passes", 4, 1, 6));
+	gui.add(denoiseColorSigma.setup("Denoise color sigma", .1, .01, 1));
 	bHide = true;
 
 	theCam = &mainCam;
@@ -180,6 +463,20 @@ void ofApp::setup() {
 
 	//scene.push_back(new Sphere(glm::vec3(-.5, -1.5, 0), .5, ofColor::darkGreen));											//green sphere
 
+	//implicit blob, two spheres and a torus blended together
+	SDFObject* blob = new SDFObject(glm::vec3(1.5, -2, 1), 1.2, ofColor::darkGreen);
+	blob->add(SDFObject::SPHERE, glm::vec3(-.3, 0, 0), glm::vec3(.45));
+	blob->add(SDFObject::SPHERE, glm::vec3(.4, .2, 0), glm::vec3(.35));
+	blob->add(SDFObject::TORUS, glm::vec3(0, -.45, 0), glm::vec3(.6, .12, 0));
+	blob->add(SDFObject::PLANE, glm::vec3(0, .35, 0), glm::vec3(0, 1, 0), SDFObject::INTERSECT);		//flat top
+	scene.push_back(blob);
+
+	//mirror and glass spheres, reflection and refraction are only traced in wavefront mode ('w')
+	scene.push_back(new Sphere(glm::vec3(-.5, -2.25, 0), .75, ofColor::lightGray));								//mirror sphere
+	scene.back()->setMaterial(.8, 0);
+
+	scene.push_back(new Sphere(glm::vec3(3.5, -2.4, 2), .6, ofColor::white));									//glass sphere
+	scene.back()->setMaterial(0, .9, 1.5);
 
 	light.clear();
 
@@ -189,6 +486,8 @@ void ofApp::setup() {
 
 	light.push_back(new Light(glm::vec3(-5, -1, 20), .2));				//bottom light
 
+	baseLightCount = light.size();
+
 
 	scene[0]->setImage(groundTexture);
 	scene[0]->setImageSpec(groundTextureSpecular);
@@ -200,6 +499,10 @@ void ofApp::setup() {
 
 	cout << "h to toggle GUI" << endl;
 	cout << "t to start ray tracer" << endl;
+	cout << "d to toggle denoiser" << endl;
+	cout << "w to toggle wavefront tracer (reflection/refraction)" << endl;
+	cout << "c to copy the current view camera into the render camera" << endl;
+	cout << "l to spawn a rig of small bounded lights, g to check the light grid against brute force" << endl;
 }
 
 //--------------------------------------------------------------
@@ -224,7 +527,8 @@ void ofApp::draw() {
 
 	//draw all lights
 	for (int i = 0; i < light.size(); i++) {
-		light[i]->setIntensity(intensity);
+		if (i < baseLightCount) light[i]->setIntensity(intensity);			//rig lights keep their own intensity
+		light[i]->setSamples(shadowSamples);
 		light[i]->draw();
 	}
 
@@ -257,12 +561,32 @@ void ofApp::keyPressed(int key) {
 		break;
 	case 't':
 		drawImage = false;
-		rayTrace();
+		if (wavefrontToggle) rayTraceWavefront();
+		else rayTrace();
 		drawImage = true;
 		break;
 	case 'h':
 		bHide = !bHide;
 		break;
+	case 'd':
+		denoiseToggle = !denoiseToggle;
+		break;
+	case 'w':
+		wavefrontToggle = !wavefrontToggle;
+		break;
+	case 'l':
+		spawnLightRig();
+		break;
+	case 'g':
+		verifyLightGrid();
+		break;
+	case 'c':
+		//export the current view into the render camera and keep the preview in sync
+		renderCam.setFromCamera(*theCam, (float)imageWidth / imageHeight);
+		previewCam.setPosition(renderCam.position);
+		previewCam.lookAt(renderCam.position + renderCam.aim, renderCam.view.up);
+		previewCam.setFov(theCam->getFov());
+		break;
 	default:
 		break;
 	}
@@ -327,6 +651,25 @@ void ofApp::rayTrace() {
 	float distance = FLT_MIN;
 	float close = FLT_MAX;
 	closestIndex = 0;
+
+	buildLights();
+
+	//reset feature buffers for the denoiser
+	int w = image.getWidth();
+	int h = image.getHeight();
+	colorBuffer.assign(w * h, glm::vec3(0));
+	normalBuffer.assign(w * h, glm::vec3(0));
+	albedoBuffer.assign(w * h, glm::vec3(0));
+	depthBuffer.assign(w * h, 0);
+
+	//pixel footprint for adaptive sphere tracing
+	for (int k = 0; k < scene.size(); k++) {
+		scene[k]->setPixelAngle(renderCam.getPixelAngle(w));
+	}
+
+	//primary ray directions, cached while the camera does not move
+	const vector<glm::vec3>& dirs = renderCam.getDirections(w, h);
+
 	for (int i = 0; i < image.getWidth(); i++) {
 		for (int j = 0; j < image.getHeight(); j++) {
 			background = true;																//reset variables every pixel
@@ -334,15 +677,12 @@ void ofApp::rayTrace() {
 			close = FLT_MAX;
 			closestIndex = 0;
 
-			float u = (i + .5) / image.getWidth();
-			float v = 1 - (j + .5) / image.getHeight();
-
-			Ray r = renderCam.getRay(u, v);
+			Ray r = Ray(renderCam.position, dirs[j * w + i]);
 			for (int k = 0; k < scene.size(); k++) {
 				if (scene[k]->intersect(r, scene[k]->intersectionPoint, glm::vec3(0, 1, 0))) {
 					background = false;														//if intersected with scene object, pixel is not background
 
-					distance = glm::distance(r.p, scene[k]->position);						//calculate distance of intersection
+					distance = glm::distance(r.p, scene[k]->intersectionPoint);				//calculate distance of intersection
 					if (distance < close)													//if current object is closest to viewplane
 					{
 						closestIndex = k;													//save index of closest object
@@ -351,13 +691,23 @@ void ofApp::rayTrace() {
 				}
 			}
 			if (!background) {
+				//the closest object's intersection point is the hit for this ray
+				glm::vec3 hitPoint = scene[closestIndex]->intersectionPoint;
+
 				//get diffuse and specular
-				ofColor diffuse = scene[closestIndex]->getDiffuse(r.evalPoint(close));
-				ofColor specular = scene[closestIndex]->getSpecular(r.evalPoint(close));
+				ofColor diffuse = scene[closestIndex]->getDiffuse(hitPoint);
+				ofColor specular = scene[closestIndex]->getSpecular(hitPoint);
 
 				//add shading contribution
-				closest = shade(r.evalPoint(close), scene[closestIndex]->getNormal(glm::vec3(0, 0, 0)), diffuse, close, specular, power, r);
+				closest = shade(hitPoint, scene[closestIndex]->getNormal(glm::vec3(0, 0, 0)), diffuse, close, specular, power, r);
 				image.setColor(i, j, closest);
+
+				//save features for the denoiser
+				int index = j * w + i;
+				colorBuffer[index] = glm::vec3(closest.r, closest.g, closest.b) / 255.0f;
+				normalBuffer[index] = scene[closestIndex]->getNormal(glm::vec3(0, 0, 0));
+				albedoBuffer[index] = glm::vec3(diffuse.r, diffuse.g, diffuse.b) / 255.0f;
+				depthBuffer[index] = close;
 			}
 			else if (background) {
 				image.setColor(i, j, ofColor::black);
@@ -365,6 +715,11 @@ void ofApp::rayTrace() {
 		}
 	}
 
+	if (denoiseToggle) {
+		cout << "denoising..." << endl;
+		denoise();
+	}
+
 	image.save("output.png");
 	image.load("output.png");
 
@@ -381,35 +736,167 @@ void ofApp::rayTrace() {
 //returns shaded color
 ofColor ofApp::shade(const glm::vec3& p, const glm::vec3& norm, const ofColor diffuse, float distance, const ofColor specular, float power, Ray r) {
 	ofColor shaded = (0, 0, 0);
-	glm::vec3 p1 = p;
 
-	//loop through all lights
+	//only visit unbounded lights and the lights binned near p
+	const vector<int>* lists[2] = { &lightGrid.global, &lightGrid.query(p) };
+
+	for (int l = 0; l < 2; l++) {
+		for (int i = 0; i < lists[l]->size(); i++) {
+			const LightRecord& current = lightRecords[(*lists[l])[i]];
+			float visibility = current.falloff(glm::distance(current.position, p));
+			if (visibility <= 0) continue;
+
+			//test for shadows
+			if (closestIndex < 2) {								//if the closest object is one of the planes
+				visibility *= lightVisibility(scene[closestIndex]->getIntersectionPoint(), current);
+			}
+			if (visibility > 0) {
+				//add shading contribution for current light, scaled by how much of it is visible
+				shaded += phong(p, norm, diffuse, specular, power, distance, r, current) * visibility;
+			}
+		}
+	}
+	return shaded;
+}
+
+//--------------------------------------------------------------
+//copies the scene lights into compact records and bins them
+//into the light grid, called once per render
+void ofApp::buildLights() {
+	lightRecords.clear();
 	for (int i = 0; i < light.size(); i++) {
-		blocked = false;
+		LightRecord record;
+		record.position = light[i]->position;
+		record.intensity = light[i]->intensity;
+		record.radius = light[i]->radius;
+		record.range = light[i]->range;
+		record.samples = light[i]->samples;
+		lightRecords.push_back(record);
+	}
+	lightGrid.build(lightRecords);
+}
 
-		//test for shadows
-		if (closestIndex < 2) {								//if the closest object is one of the planes
+//--------------------------------------------------------------
+//replaces the debug light rig with rigCount small bounded lights
+//scattered over the floor and wall, exercises the light grid
+void ofApp::spawnLightRig() {
+	for (int i = baseLightCount; i < light.size(); i++) {
+		delete light[i];
+	}
+	light.resize(baseLightCount);
+
+	for (int i = 0; i < rigCount; i++) {
+		glm::vec3 p = glm::vec3(ofRandom(-7, 5), ofRandom(-2.5, 3), ofRandom(-4.5, 5));
+		Light* rigLight = new Light(p, rigIntensity);
+		rigLight->radius = .05;
+		rigLight->setRange(rigRange);
+		light.push_back(rigLight);
+	}
+	cout << "spawned " << (int)rigCount << " rig lights" << endl;
+}
 
-			for (int k = 0; k < 2; k++) {
-				if (scene[k]->intersect(r, p1, glm::vec3(0, 1, 0))) {													//check if current point intersected with ground plane
+//--------------------------------------------------------------
+//checks the light grid against brute force at random points
+//every light that reaches a point must be listed for that point
+void ofApp::verifyLightGrid() {
+	buildLights();
+
+	int missing = 0;
+	int visited = 0;
+	const int points = 10000;
+	for (int n = 0; n < points; n++) {
+		glm::vec3 p = glm::vec3(ofRandom(-8, 6), ofRandom(-3.5, 4), ofRandom(-5.5, 6));
+		const vector<int>& cell = lightGrid.query(p);
+		visited += lightGrid.global.size() + cell.size();
+
+		for (int i = 0; i < lightRecords.size(); i++) {
+			if (lightRecords[i].falloff(glm::distance(lightRecords[i].position, p)) <= 0) continue;
+			bool found = std::find(lightGrid.global.begin(), lightGrid.global.end(), i) != lightGrid.global.end() ||
+				std::find(cell.begin(), cell.end(), i) != cell.end();
+			if (!found) missing++;
+		}
+	}
+	cout << "light grid: " << missing << " missing lights, " << (float)visited / points << " of " << lightRecords.size() << " lights visited per point" << endl;
+}
 
-					Ray shadowRay = Ray(scene[k]->getIntersectionPoint(), light[i]->position - scene[k]->getIntersectionPoint());
+//--------------------------------------------------------------
+//returns the fraction of the light visible from point p
+//point lights cast a single shadow ray, area lights test a few
+//boundary samples first and only take the full stratified set
+//when they disagree (penumbra)
+float ofApp::lightVisibility(const glm::vec3& p, const LightRecord& light) {
+	//point light
+	if (light.samples <= 1) {
+		return 1 - countOccluded(p, &light.position, 1);
+	}
 
-					//check all sphere objects
-					for (int j = 2; j < scene.size(); j++) {
-						if (scene[j]->intersect(shadowRay, p1, scene[j]->getNormal(p1))) {
-							blocked = true;
-						}
-					}
-				}
+	//disk through the light center facing p
+	glm::vec3 w = glm::normalize(p - light.position);
+	glm::vec3 a = glm::abs(w.x) > .9 ? glm::vec3(0, 1, 0) : glm::vec3(1, 0, 0);
+	glm::vec3 u = glm::normalize(glm::cross(a, w));
+	glm::vec3 v = glm::cross(w, u);
+
+	//center and rim samples, if they all agree p is fully lit or fully shadowed
+	glm::vec3 boundary[5] = {
+		light.position,
+		light.position + u * light.radius,
+		light.position - u * light.radius,
+		light.position + v * light.radius,
+		light.position - v * light.radius
+	};
+
+	int blockedCount = countOccluded(p, boundary, 5);
+	if (blockedCount == 0) return 1;
+	if (blockedCount == 5) return 0;
+
+	//penumbra - jittered stratified samples mapped onto the disk
+	//shadowTargets is reused between calls so it only grows, never reallocates per point
+	int n = light.samples;
+	shadowTargets.resize(n * n);
+	for (int sx = 0; sx < n; sx++) {
+		for (int sy = 0; sy < n; sy++) {
+			//concentric square to disk mapping keeps the strata evenly sized
+			float x = 2 * (sx + ofRandom(1)) / n - 1;
+			float y = 2 * (sy + ofRandom(1)) / n - 1;
+			float radius, theta;
+			if (x == 0 && y == 0) {
+				radius = 0;
+				theta = 0;
 			}
+			else if (glm::abs(x) > glm::abs(y)) {
+				radius = x;
+				theta = (PI / 4) * (y / x);
+			}
+			else {
+				radius = y;
+				theta = (PI / 2) - (PI / 4) * (x / y);
+			}
+			radius *= light.radius;
+			shadowTargets[sx * n + sy] = light.position + u * (radius * cos(theta)) + v * (radius * sin(theta));
 		}
-		if (!blocked) {
-			//add shading contribution for current light
-			shaded += phong(p, norm, diffuse, specular, power, distance, r, *light[i]);
+	}
+	return 1 - (float)countOccluded(p, shadowTargets.data(), n * n) / (n * n);
+}
+
+//--------------------------------------------------------------
+//casts a batch of shadow rays from p to each of the count targets
+//returns how many of them are blocked by a sphere
+int ofApp::countOccluded(const glm::vec3& p, const glm::vec3* targets, int count) {
+	int blockedCount = 0;
+	glm::vec3 point, normal;
+	for (int t = 0; t < count; t++) {
+		Ray shadowRay = Ray(p, targets[t] - p);
+		float maxDistance = glm::distance(p, targets[t]);
+
+		//check all sphere objects
+		for (int j = 2; j < scene.size(); j++) {
+			if (scene[j]->intersect(shadowRay, point, normal) && glm::distance(p, point) < maxDistance) {
+				blockedCount++;
+				break;
+			}
 		}
 	}
-	return shaded;
+	return blockedCount;
 }
 
 //--------------------------------------------------------------
@@ -418,12 +905,12 @@ ofColor ofApp::shade(const glm::vec3& p, const glm::vec3& norm, const ofColor di
 // phong
 // ambient
 //returns shaded color
-ofColor ofApp::phong(const glm::vec3& p, const glm::vec3& norm, const ofColor diffuse, const ofColor specular, float power, float distance, Ray r, Light light) {
+ofColor ofApp::phong(const glm::vec3& p, const glm::vec3& norm, const ofColor diffuse, const ofColor specular, float power, float distance, const Ray& r, const LightRecord& light) {
 	ofColor phong = ofColor(0, 0, 0);
 	glm::vec3 h = glm::vec3(0);
 
 	glm::vec3 l = glm::normalize(light.position - p);
-	glm::vec3 v = glm::normalize(renderCam.position - p);
+	glm::vec3 v = glm::normalize(r.p - p);
 	h = glm::normalize(l + v);
 
 	float distance1 = glm::distance(light.position, p);
@@ -447,7 +934,7 @@ ofColor ofApp::ambient(const ofColor diffuse) {
 //--------------------------------------------------------------
 //calculates lambert shading
 //returns shaded color
-ofColor ofApp::lambert(const glm::vec3& p, const glm::vec3& norm, const ofColor diffuse, float distance, Ray r, Light light) {
+ofColor ofApp::lambert(const glm::vec3& p, const glm::vec3& norm, const ofColor diffuse, float distance, const Ray& r, const LightRecord& light) {
 	ofColor lambert = ofColor(0, 0, 0);
 	float distance1 = glm::distance(light.position, p);
 
@@ -456,3 +943,291 @@ ofColor ofApp::lambert(const glm::vec3& p, const glm::vec3& norm, const ofColor
 
 	return lambert;
 }
+
+
+//--------------------------------------------------------------
+//edge-aware a-trous wavelet filter over the rendered image
+//guided by the normal, depth and albedo feature buffers
+//rows are split across threads, each pass doubles the filter step
+void ofApp::denoise() {
+	int h = image.getHeight();
+	vector<glm::vec3> filtered(colorBuffer.size());
+
+	int threads = std::max(1, (int)std::thread::hardware_concurrency());
+	int rows = (h + threads - 1) / threads;
+
+	for (int pass = 0; pass < denoisePasses; pass++) {
+		int step = 1 << pass;
+		vector<std::thread> workers;
+		for (int t = 0; t < threads; t++) {
+			int jStart = t * rows;
+			int jEnd = std::min(h, jStart + rows);
+			if (jStart >= jEnd) break;
+			workers.push_back(std::thread(&ofApp::denoiseRows, this, jStart, jEnd, step, std::cref(colorBuffer), std::ref(filtered)));
+		}
+		for (int t = 0; t < workers.size(); t++) {
+			workers[t].join();
+		}
+		colorBuffer.swap(filtered);
+	}
+
+	writeImage();
+}
+
+//--------------------------------------------------------------
+//copies the float color buffer into the image
+void ofApp::writeImage() {
+	int w = image.getWidth();
+	int h = image.getHeight();
+	for (int j = 0; j < h; j++) {
+		for (int i = 0; i < w; i++) {
+			glm::vec3 c = glm::clamp(colorBuffer[j * w + i], 0.0f, 1.0f) * 255.0f;
+			image.setColor(i, j, ofColor(c.r, c.g, c.b));
+		}
+	}
+}
+
+//--------------------------------------------------------------
+//filters rows [jStart, jEnd) with one 5x5 a-trous pass
+//taps are weighted by the B3 spline kernel and stopped at
+//color, normal, depth and albedo edges
+void ofApp::denoiseRows(int jStart, int jEnd, int step, const vector<glm::vec3>& in, vector<glm::vec3>& out) {
+	const float kernel[5] = { 1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16 };
+	const float normalPower = 128;
+	const float depthSigma = .5;
+	const float albedoSigma = .1;
+
+	int w = image.getWidth();
+	int h = image.getHeight();
+
+	//color edges get sharper as the step grows
+	float colorSigma = denoiseColorSigma / step;
+
+	for (int j = jStart; j < jEnd; j++) {
+		for (int i = 0; i < w; i++) {
+			int p = j * w + i;
+
+			//background pixels are left untouched
+			if (depthBuffer[p] == 0) {
+				out[p] = in[p];
+				continue;
+			}
+
+			glm::vec3 cp = in[p];
+			glm::vec3 np = normalBuffer[p];
+			glm::vec3 ap = albedoBuffer[p];
+			float zp = depthBuffer[p];
+
+			glm::vec3 sum = glm::vec3(0);
+			float weightSum = 0;
+
+			for (int y = -2; y <= 2; y++) {
+				int jq = j + y * step;
+				if (jq < 0 || jq >= h) continue;
+				for (int x = -2; x <= 2; x++) {
+					int iq = i + x * step;
+					if (iq < 0 || iq >= w) continue;
+					int q = jq * w + iq;
+					if (depthBuffer[q] == 0) continue;
+
+					glm::vec3 dc = in[q] - cp;
+					glm::vec3 da = albedoBuffer[q] - ap;
+					float dz = glm::abs(depthBuffer[q] - zp);
+
+					float wc = glm::exp(-glm::dot(dc, dc) / colorSigma);
+					float wn = glm::pow(glm::max(zero, glm::dot(np, normalBuffer[q])), normalPower);
+					float wz = glm::exp(-dz / (depthSigma * step));
+					float wa = glm::exp(-glm::dot(da, da) / albedoSigma);
+
+					float weight = kernel[x + 2] * kernel[y + 2] * wc * wn * wz * wa;
+					sum += in[q] * weight;
+					weightSum += weight;
+				}
+			}
+			out[p] = weightSum > 0 ? sum / weightSum : cp;
+		}
+	}
+}
+
+
+//--------------------------------------------------------------
+//wavefront ray tracer with reflection and refraction
+//every bounce generation is kept in one ray queue, binned by
+//direction, intersected as a batch, then shaded as a batch
+//sorted by object. shading spawns the next generation
+void ofApp::rayTraceWavefront() {
+
+	cout << "drawing (wavefront)..." << endl;
+
+	buildLights();
+
+	int w = image.getWidth();
+	int h = image.getHeight();
+
+	//pixel footprint for adaptive sphere tracing
+	for (int k = 0; k < scene.size(); k++) {
+		scene[k]->setPixelAngle(renderCam.getPixelAngle(w));
+	}
+	colorBuffer.assign(w * h, glm::vec3(0));
+	normalBuffer.assign(w * h, glm::vec3(0));
+	albedoBuffer.assign(w * h, glm::vec3(0));
+	depthBuffer.assign(w * h, 0);
+
+	//primary rays
+	const vector<glm::vec3>& dirs = renderCam.getDirections(w, h);
+	vector<PathRay> queue;
+	queue.reserve(w * h);
+	for (int j = 0; j < h; j++) {
+		for (int i = 0; i < w; i++) {
+			PathRay path = { Ray(renderCam.position, dirs[j * w + i]), glm::vec3(1), j * w + i, 0 };
+			queue.push_back(path);
+		}
+	}
+
+	vector<PathHit> hits;
+	vector<PathRay> next;
+	while (!queue.empty()) {
+		binByDirection(queue);
+		intersectStage(queue, hits);
+		next.clear();
+		shadeStage(queue, hits, next);
+		queue.swap(next);
+	}
+
+	if (denoiseToggle) {
+		cout << "denoising..." << endl;
+		denoise();
+	}
+	else {
+		writeImage();
+	}
+
+	image.save("output.png");
+	image.load("output.png");
+
+	cout << "render saved" << endl;
+}
+
+//--------------------------------------------------------------
+//groups rays by direction octant so neighbouring rays in the
+//queue tend to hit the same objects
+void ofApp::binByDirection(vector<PathRay>& rays) {
+	vector<int> count(9, 0);
+	vector<int> octant(rays.size());
+	for (int i = 0; i < rays.size(); i++) {
+		glm::vec3 d = rays[i].ray.d;
+		octant[i] = (d.x < 0 ? 1 : 0) | (d.y < 0 ? 2 : 0) | (d.z < 0 ? 4 : 0);
+		count[octant[i] + 1]++;
+	}
+	for (int b = 1; b < 9; b++) {
+		count[b] += count[b - 1];
+	}
+
+	vector<PathRay> sorted;
+	sorted.reserve(rays.size());
+	vector<int> order(rays.size());
+	for (int i = 0; i < rays.size(); i++) {
+		order[count[octant[i]]++] = i;
+	}
+	for (int i = 0; i < order.size(); i++) {
+		sorted.push_back(rays[order[i]]);
+	}
+	rays.swap(sorted);
+}
+
+//--------------------------------------------------------------
+//finds the closest hit for every ray in the queue
+void ofApp::intersectStage(const vector<PathRay>& rays, vector<PathHit>& hits) {
+	hits.resize(rays.size());
+	glm::vec3 point, normal;
+	for (int i = 0; i < rays.size(); i++) {
+		const Ray& r = rays[i].ray;
+		PathHit& hit = hits[i];
+		hit.ray = i;
+		hit.object = -1;
+		float close = FLT_MAX;
+		for (int k = 0; k < scene.size(); k++) {
+			if (scene[k]->intersect(r, point, normal)) {
+				float d = glm::distance(r.p, point);
+				if (d < close) {
+					close = d;
+					hit.object = k;
+					hit.point = point;
+					hit.normal = glm::normalize(normal);
+				}
+			}
+		}
+	}
+}
+
+//--------------------------------------------------------------
+//shades every hit with direct lighting, then spawns reflected
+//and refracted rays for the next generation. rays past the
+//roulette depth survive with probability equal to their throughput
+void ofApp::shadeStage(const vector<PathRay>& rays, vector<PathHit>& hits, vector<PathRay>& next) {
+	const float offset = .001;
+
+	//keep hits on the same object together, stable so the direction
+	//binning from binByDirection survives within each object
+	std::stable_sort(hits.begin(), hits.end(), [](const PathHit& a, const PathHit& b) { return a.object < b.object; });
+
+	for (int i = 0; i < hits.size(); i++) {
+		const PathHit& hit = hits[i];
+		if (hit.object < 0) continue;								//misses add background (black)
+
+		const PathRay& path = rays[hit.ray];
+		SceneObject* obj = scene[hit.object];
+
+		//restore per-object hit state used by texture lookups and shadows
+		obj->setIntersectionPoint(hit.point);
+		closestIndex = hit.object;
+
+		ofColor diffuse = obj->getDiffuse(hit.point);
+		ofColor specular = obj->getSpecular(hit.point);
+		float distance = glm::distance(path.ray.p, hit.point);
+		glm::vec3 d = glm::normalize(path.ray.d);
+
+		//direct lighting, weighted by whatever is not reflected or refracted
+		//skipped for rays leaving a transparent object, the inside is not lit
+		float passed = obj->reflectivity + obj->transparency;
+		bool exiting = obj->transparency > 0 && glm::dot(d, hit.normal) > 0;
+		if (!exiting) {
+			ofColor direct = shade(hit.point, hit.normal, diffuse, distance, specular, power, path.ray);
+			glm::vec3 color = glm::vec3(direct.r, direct.g, direct.b) / 255.0f;
+			colorBuffer[path.pixel] += path.throughput * color * glm::max(zero, 1 - passed);
+		}
+
+		//save features for the denoiser from the first hit
+		if (path.depth == 0) {
+			normalBuffer[path.pixel] = hit.normal;
+			albedoBuffer[path.pixel] = glm::vec3(diffuse.r, diffuse.g, diffuse.b) / 255.0f;
+			depthBuffer[path.pixel] = distance;
+		}
+
+		if (passed <= 0 || path.depth + 1 >= maxDepth) continue;
+
+		//russian roulette
+		glm::vec3 throughput = path.throughput;
+		if (path.depth >= rouletteDepth) {
+			float q = glm::min(1.0f, glm::max(throughput.r, glm::max(throughput.g, throughput.b)));
+			if (ofRandom(1) >= q) continue;
+			throughput /= q;
+		}
+
+		if (obj->reflectivity > 0) {
+			glm::vec3 dir = glm::reflect(d, hit.normal);
+			PathRay bounce = { Ray(hit.point + dir * offset, dir), throughput * obj->reflectivity, path.pixel, path.depth + 1 };
+			next.push_back(bounce);
+		}
+		if (obj->transparency > 0) {
+			//flip the normal and ratio when leaving the object
+			bool entering = glm::dot(d, hit.normal) < 0;
+			glm::vec3 n = entering ? hit.normal : -hit.normal;
+			float eta = entering ? 1 / obj->ior : obj->ior;
+			glm::vec3 dir = glm::refract(d, n, eta);
+			if (glm::length(dir) == 0) dir = glm::reflect(d, n);		//total internal reflection
+			PathRay bounce = { Ray(hit.point + dir * offset, dir), throughput * obj->transparency, path.pixel, path.depth + 1 };
+			next.push_back(bounce);
+		}
+	}
+}
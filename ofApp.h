@@ -8,6 +8,7 @@
 #include "ofxGui.h"
 
 #include <glm/gtx/intersect.hpp>
+#include <thread>
 
 //  General Purpose Ray class 
 //
@@ -31,8 +32,10 @@ public:
 	virtual bool intersect(const Ray& ray, glm::vec3& point, glm::vec3& normal) { cout << "SceneObject::intersect" << endl; return false; }
 	virtual glm::vec3 getNormal(const glm::vec3& p) { return glm::vec3(0); }
 	virtual glm::vec3 getIntersectionPoint() { return glm::vec3(1); }
+	virtual void setIntersectionPoint(const glm::vec3& p) { intersectionPoint = p; }
 	virtual void setImage(ofImage i) {}
 	virtual void setImageSpec(ofImage i) {}
+	virtual void setPixelAngle(float a) {}
 	virtual ofColor getDiffuse(glm::vec3 p) { return diffuseColor; }
 	virtual ofColor getSpecular(glm::vec3 p) { return specularColor; }
 	virtual float getWidth() { return width; }
@@ -47,6 +50,11 @@ public:
 	//
 	ofColor diffuseColor = ofColor::grey;    // default colors - can be changed.
 	ofColor specularColor = ofColor::lightGray;
+	float reflectivity = 0;     // fraction of light mirrored, only used by the wavefront tracer
+	float transparency = 0;     // fraction of light refracted, only used by the wavefront tracer
+	float ior = 1.5;            // index of refraction for transparent objects
+
+	void setMaterial(float r, float t, float i = 1.5) { reflectivity = r; transparency = t; ior = i; }
 
 	ofImage image;
 
@@ -95,8 +103,50 @@ public:
 	void setIntensity(float i) {
 		intensity = i;
 	}
+	void setSamples(int n) {
+		samples = n;
+	}
+	void setRange(float r) {
+		range = r;
+	}
 	float radius = .5;
 	float intensity = 0.0;
+	int samples = 1;          // shadow samples per side, 1 is a point light, n > 1 casts n * n rays over the sphere
+	float range = 0;          // influence radius, 0 means the light reaches the whole scene
+};
+
+//  Compact copy of a Light used while rendering, so shading does not
+//  touch (or copy) the full SceneObject
+//
+struct LightRecord {
+	glm::vec3 position;
+	float intensity;
+	float radius;
+	float range;
+	int samples;
+
+	// smooth window that reaches 0 at the influence radius
+	float falloff(float d) const {
+		if (range <= 0) return 1;
+		float x = glm::clamp(1 - (d * d) / (range * range), 0.0f, 1.0f);
+		return x * x;
+	}
+};
+
+//  Uniform grid over the bounded lights. Each cell lists the lights whose
+//  influence sphere overlaps it, unbounded lights live in the global list
+//  and are visited by every shading point
+//
+class LightGrid {
+public:
+	void build(const vector<LightRecord>& lights, int maxCells = 32);
+	const vector<int>& query(const glm::vec3& p);
+
+	vector<int> global;
+	vector<vector<int> > cells;
+	glm::vec3 min, cellSize;
+	glm::ivec3 dims = glm::ivec3(0);
+	vector<int> empty;
 };
 
 
@@ -115,7 +165,7 @@ class Plane : public SceneObject {
 public:
 	Plane(glm::vec3 p, glm::vec3 n, ofColor diffuse,
 		float w, float h) {
-		position = p; normal = n;
+		position = p; normal = glm::normalize(n);
 		width = w;
 		height = h;
 		diffuseColor = diffuse;
@@ -183,6 +233,60 @@ public:
 	int walltiles = 3;
 };
 
+//  Implicit object rendered by sphere tracing. The shape is a list of
+//  primitives (relative to position) joined with a smooth union, or cut
+//  with an intersection, and can be repeated along any axis. The first
+//  primitive always seeds the shape, its op is ignored.
+//  boundRadius must enclose one copy of the shape, rays that miss it are
+//  rejected before marching. With repeat set the bound only covers the
+//  center copy (used for drawing) and rays march up to maxDistance
+//
+class SDFObject : public SceneObject {
+public:
+	enum Shape { SPHERE, BOX, TORUS, PLANE };
+	enum Op { UNION, INTERSECT };
+	struct Primitive {
+		Shape shape;
+		glm::vec3 center;
+		glm::vec3 size;       // sphere: x = radius, box: half extents, torus: x = major, y = minor radius, plane: normal
+		Op op;
+		int plane;            // index into planes for PLANE primitives
+	};
+
+	SDFObject(glm::vec3 p, float bound, ofColor diffuse = ofColor::lightGray) { position = p; boundRadius = bound; diffuseColor = diffuse; }
+	SDFObject() {}
+	bool intersect(const Ray& ray, glm::vec3& point, glm::vec3& normal);
+	float sdf(const glm::vec3& p);
+	void add(Shape shape, glm::vec3 center, glm::vec3 size, Op op = UNION) {
+		Primitive prim = { shape, center, size, op, -1 };
+		if (shape == PLANE) {
+			//half-space below the plane, evaluated through Plane::sdf
+			prim.plane = planes.size();
+			planes.push_back(Plane(center, size, diffuseColor, 0, 0));
+		}
+		primitives.push_back(prim);
+	}
+	void draw() {
+		ofNoFill();
+		ofDrawSphere(position, boundRadius);
+		ofFill();
+	}
+	void setPixelAngle(float a) { pixelAngle = a; }
+
+	glm::vec3 getNormal(const glm::vec3& p) { return normal; }
+
+	vector<Primitive> primitives;
+	vector<Plane> planes;
+	glm::vec3 normal;
+	glm::vec3 repeat = glm::vec3(0);     // repetition period per axis, 0 = no repetition, the shape must fit in one period
+	float blend = .2;                    // smooth union radius
+	float boundRadius = 1.0;
+	float maxDistance = 100;             // march limit when repeat disables the bound
+	float pixelAngle = .001;             // angle covered by one pixel, hit epsilon grows with distance
+	float minEpsilon = .0001;
+	int maxSteps = 128;
+};
+
 // view plane for render camera
 // 
 class  ViewPlane : public Plane {
@@ -193,7 +297,7 @@ public:
 		min = glm::vec2(-3, -2);
 		max = glm::vec2(3, 2);
 		position = glm::vec3(0, 0, 5);
-		normal = glm::vec3(0, 0, 1);      // viewplane currently limited to Z axis orientation
+		normal = glm::vec3(0, 0, 1);
 	}
 
 	void setSize(glm::vec2 min, glm::vec2 max) { this->min = min; this->max = max; }
@@ -202,7 +306,14 @@ public:
 	glm::vec3 toWorld(float u, float v);   //   (u, v) --> (x, y, z) [ world space ]
 
 	void draw() {
-		ofDrawRectangle(glm::vec3(min.x, min.y, position.z), width(), height());
+		glm::vec3 p0 = toWorld(0, 0);
+		glm::vec3 p1 = toWorld(1, 0);
+		glm::vec3 p2 = toWorld(1, 1);
+		glm::vec3 p3 = toWorld(0, 1);
+		ofDrawLine(p0, p1);
+		ofDrawLine(p1, p2);
+		ofDrawLine(p2, p3);
+		ofDrawLine(p3, p0);
 	}
 	float width() {
 		return (max.x - min.x);
@@ -227,26 +338,70 @@ public:
 	//  coordinate system.
 	//
 	glm::vec2 min, max;
+
+	// local axes of the plane in world space, position is the plane center
+	//
+	glm::vec3 right = glm::vec3(1, 0, 0);
+	glm::vec3 up = glm::vec3(0, 1, 0);
 };
 
 
-//  render camera  - currently must be z axis aligned (we will improve this in project 4)
+//  render camera  - look-at camera with a vertical field of view.
+//  The view plane basis is computed once in updateBasis(), call it
+//  after changing position, aim or up directly
 //
 class RenderCam : public SceneObject {
 public:
 	RenderCam() {
 		position = glm::vec3(0, 0, 10);
 		aim = glm::vec3(0, 0, -1);
+		up = glm::vec3(0, 1, 0);
+		updateBasis();
 	}
 	Ray getRay(float u, float v);
+	void getRays(int i0, int j0, int tileWidth, int tileHeight, int imageWidth, int imageHeight, vector<glm::vec3>& dirs);
+	const vector<glm::vec3>& getDirections(int imageWidth, int imageHeight);
+	float getPixelAngle(int imageWidth);
+	void lookAt(glm::vec3 target, glm::vec3 up = glm::vec3(0, 1, 0));
+	void setFov(float fov, float aspect);
+	void setFromCamera(ofCamera& cam, float aspect);
+	void updateBasis();
 	void draw() { ofDrawBox(position, 1.0); };
 	void drawFrustum();
 
 	glm::vec3 aim;
+	glm::vec3 up;
+	float viewDistance = 5;  // distance from the camera to the view plane
 	ViewPlane view;          // The camera viewplane, this is the view that we will render 
+
+	// normalized ray directions for every pixel, reused while the camera is static
+	//
+	bool cacheRays = true;
+	bool cacheValid = false;
+	int cacheWidth = 0;
+	int cacheHeight = 0;
+	vector<glm::vec3> rayCache;
 };
 
 
+//  One ray in the wavefront queue, carries the pixel it contributes to
+//  and how much of that pixel's color it still accounts for
+//
+struct PathRay {
+	Ray ray;
+	glm::vec3 throughput;
+	int pixel;
+	int depth;
+};
+
+//  Result of the intersect stage for one queued ray
+//
+struct PathHit {
+	int ray;              // index into the ray queue
+	int object;           // index into scene, -1 for a miss
+	glm::vec3 point;
+	glm::vec3 normal;
+};
 
 class ofApp : public ofBaseApp {
 
@@ -267,13 +422,25 @@ public:
 	void dragEvent(ofDragInfo dragInfo);
 	void gotMessage(ofMessage msg);
 	void rayTrace();
+	void rayTraceWavefront();
+	void binByDirection(vector<PathRay>& rays);
+	void intersectStage(const vector<PathRay>& rays, vector<PathHit>& hits);
+	void shadeStage(const vector<PathRay>& rays, vector<PathHit>& hits, vector<PathRay>& next);
+	void writeImage();
 	void drawGrid();
 	void drawAxis(glm::vec3 position);
 	ofColor ambient(ofColor diffuse);
-	ofColor lambert(const glm::vec3& p, const glm::vec3& norm, const ofColor diffuse, float distance, Ray r, Light light);
-	ofColor phong(const glm::vec3& p, const glm::vec3& norm, const ofColor diffuse, const ofColor specular, float power, float distance, Ray r, Light light);
+	ofColor lambert(const glm::vec3& p, const glm::vec3& norm, const ofColor diffuse, float distance, const Ray& r, const LightRecord& light);
+	ofColor phong(const glm::vec3& p, const glm::vec3& norm, const ofColor diffuse, const ofColor specular, float power, float distance, const Ray& r, const LightRecord& light);
 	ofColor shade(const glm::vec3& p, const glm::vec3& norm, const ofColor diffuse, float distance, const ofColor specular, float power, Ray r);
+	float lightVisibility(const glm::vec3& p, const LightRecord& light);
+	void buildLights();
+	void spawnLightRig();
+	void verifyLightGrid();
+	int countOccluded(const glm::vec3& p, const glm::vec3* targets, int count);
 	ofColor textureMap(glm::vec3 p);
+	void denoise();
+	void denoiseRows(int jStart, int jEnd, int step, const vector<glm::vec3>& in, vector<glm::vec3>& out);
 
 	const float zero = 0.0;
 
@@ -302,24 +469,51 @@ public:
 	//
 	vector<SceneObject*> scene;
 	vector<Light*> light;
+	int baseLightCount = 0;		//lights past this index belong to the debug light rig
+
+	//render-time light storage, rebuilt from light at the start of each trace
+	//
+	vector<LightRecord> lightRecords;
+	LightGrid lightGrid;
+
+	//scratch buffer for penumbra shadow targets, reused across shading points
+	//
+	vector<glm::vec3> shadowTargets;
 
 	int imageWidth = 1200;
 	int imageHeight = 800;
 
 	int closestIndex = 0;
 
+	//feature buffers written by the ray tracer for the denoiser
+	//one entry per pixel, depth of 0 marks background
+	//
+	vector<glm::vec3> colorBuffer;
+	vector<glm::vec3> normalBuffer;
+	vector<glm::vec3> albedoBuffer;
+	vector<float> depthBuffer;
+
 	//state variables
 	//
 	bool drawImage = false;
 	bool trace = false;
 	bool background = true;
-	bool blocked = false;
 	bool texture = false;
 
 	//GUI
 	//
 	ofxFloatSlider power;
 	ofxFloatSlider intensity;
+	ofxIntSlider shadowSamples;
+	ofxIntSlider rigCount;
+	ofxFloatSlider rigRange;
+	ofxFloatSlider rigIntensity;
+	ofxToggle wavefrontToggle;
+	ofxIntSlider maxDepth;
+	ofxIntSlider rouletteDepth;
+	ofxToggle denoiseToggle;
+	ofxIntSlider denoisePasses;
+	ofxFloatSlider denoiseColorSigma;
 	ofxPanel gui;
 
 };